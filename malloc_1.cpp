@@ -1,6 +1,80 @@
 #include <unistd.h>
+#include <stdint.h>
 
 #define MAX_MEMORY_ALLOCATED_SIZE 100000000 // 10^8
+#define BUMP_ALIGNMENT 16
+#define MAX_CHUNK_SIZE (64*1024*1024)
+
+/*
+---------------------------------------
+            BUMP MODE
+---------------------------------------
+*/
+//when chunk_size is 0 every smalloc is its own sbrk (default)
+//otherwise we reserve the break in chunks and bump a pointer inside them
+//each new chunk doubles the chunk size, up to MAX_CHUNK_SIZE
+size_t chunk_size=0;
+char* bump_current=NULL;
+char* bump_end=NULL;
+size_t reserved_bytes=0;
+size_t used_bytes=0;
+
+void smalloc_set_chunk_size(size_t size)
+{
+    chunk_size=size;
+}
+size_t _num_reserved_bytes()
+{
+    return reserved_bytes;
+}
+size_t _num_used_bytes()
+{
+    return used_bytes;
+}
+
+static void* bump_allocate(size_t size)
+{
+    uintptr_t aligned=((uintptr_t)bump_current+BUMP_ALIGNMENT-1) & ~(uintptr_t)(BUMP_ALIGNMENT-1);
+    if(bump_current==NULL || aligned+size>(uintptr_t)bump_end) // chunk is full
+    {
+        size_t reserve=chunk_size;
+        bool oversized=false;
+        if(size+BUMP_ALIGNMENT>reserve) // sized for this request only
+        {
+            reserve=size+BUMP_ALIGNMENT;
+            oversized=true;
+        }
+        void* p_break=sbrk(reserve);
+        if(p_break == (void*)-1) // sbrk failed
+        {
+            return NULL;
+        }
+        if((char*)p_break!=bump_end) // someone else moved the break, start over
+        {
+            bump_current=(char*)p_break;
+        }
+        bump_end=(char*)p_break+reserve;
+        reserved_bytes+=reserve;
+        if(!oversized && chunk_size<MAX_CHUNK_SIZE)
+        {
+            chunk_size*=2;
+            if(chunk_size>MAX_CHUNK_SIZE)
+            {
+                chunk_size=MAX_CHUNK_SIZE;
+            }
+        }
+        aligned=((uintptr_t)bump_current+BUMP_ALIGNMENT-1) & ~(uintptr_t)(BUMP_ALIGNMENT-1);
+    }
+    bump_current=(char*)aligned+size;
+    used_bytes+=size;
+    return (void*)aligned;
+}
+
+/*
+---------------------------------------
+            IMPLEMENTATION
+---------------------------------------
+*/
 
 void* smalloc(size_t size)
 {
@@ -13,10 +87,16 @@ void* smalloc(size_t size)
     {
         return NULL;
     }
+    if(chunk_size!=0)
+    {
+        return bump_allocate(size);
+    }
     void* p_break=sbrk(size);
     if(p_break == (void*)-1) // sbrk failed
     {
         return NULL;
     }
+    reserved_bytes+=size;
+    used_bytes+=size;
     return p_break;
 }
\ No newline at end of file
@@ -21,9 +21,10 @@ typedef struct MallocMetadata
 class SortedBlocks
 {
     MetaData* list;
+    MetaData* top; // last block before the program break (wilderness)
 
 public:
-    SortedBlocks(): list(NULL)
+    SortedBlocks(): list(NULL),top(NULL)
     {
 
     }
@@ -42,24 +43,37 @@ public:
     {
         //we need to add it sorted.
         //However, since we only insert onces with larger value from sbrk
-        //It will be sorted by defenition
-        MetaData* prev=NULL;
-        MetaData* current=list;
-        while(current!=NULL)
-        {
-            prev=current;
-            current=current->next;
-        }
-
-        if(prev!=NULL) // list is in size 1 or more
+        //It will be sorted by defenition, so the last block is always the top
+        if(top!=NULL) // list is in size 1 or more
         {
-            prev->next=block;
-            block->prev=prev;
+            top->next=block;
+            block->prev=top;
         }
         else // empty list
         {
             list=block;
         }
+        top=block;
+    }
+    // grow the top block in place to size, only sbrk the missing bytes
+    bool extend_top_block(MetaData* block, size_t size)
+    {
+        if(block!=top || block->size>=size)
+        {
+            return false;
+        }
+        //make sure nobody else moved the break after our top block
+        if(sbrk(0)!=(char*)block+sizeof(MetaData)+block->size)
+        {
+            return false;
+        }
+        void* p_break=sbrk(size-block->size);
+        if(p_break == (void*)-1) // sbrk failed
+        {
+            return false;
+        }
+        block->size=size;
+        return true;
     }
     // malloc
     void* create_memory_for_block(size_t size)
@@ -74,6 +88,12 @@ public:
             }
             current=current->next;
         }
+        // the top block is free but too small, grow it instead of a new block
+        if(top!=NULL && top->is_free && extend_top_block(top,size))
+        {
+            top->is_free=false;
+            return top;
+        }
         // we got here, so we need a new block
         // by proposed solution, will be alocated in the heap (sbrk)
         size_t total_allocation_cost=size+sizeof(MetaData);
@@ -217,6 +237,11 @@ void* srealloc(void* oldp, size_t size)
     {
         return oldp;
     }
+    //last block before the break can just grow
+    if(list.extend_top_block(block_data,size))
+    {
+        return oldp;
+    }
 
     //we need a new block
 
@@ -2,11 +2,28 @@
 #include <string.h>
 #include <sys/mman.h>
 #include <cstdint>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <errno.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "srecord.h"
 #define MAX_MEMORY_ALLOCATED_SIZE 100000000 // 10^8
 #define MAX_ORDER 10
-#define MAX_SIZE_BLOCK 128*1024
+#define MAX_SIZE_BLOCK (128*1024)
 #define BLOCK_UNIT 128
 #define ALLINMENT_FACTOR 32*128*1024
+#define NUM_OF_REGIONS 32
+#define MAX_TAGS 256
+#define MIN_CLASS_POWER 256 // fine classes sit between 128 and 256 and up
+#define MAX_CLASS_POWER (16*1024)
+#define NUM_OF_CLASSES 21 // 3 steps for each power 256..16K
+#define MIN_SLOTS_IN_RUN 8
 /*
 ---------------------------------------
             HELPER STUFF
@@ -17,10 +34,131 @@ typedef struct MallocMetadata
 { 
     size_t size;
     bool is_free;
+    unsigned char tag; // sits in the padding, does not grow the metadata
     MallocMetadata* next;
     MallocMetadata* prev;
 }MetaData;
 
+//lifetime hints, every order 10 region serves one class so a long lived
+//block does not keep short lived neighbours from merging
+enum SLifetime
+{
+    SLIFETIME_ANY=-1, // plain smalloc, no preference
+    SLIFETIME_SHORT=0,
+    SLIFETIME_LONG=1,
+    SLIFETIME_PERMANENT=2
+};
+
+//fine size classes, in this mode a request that would waste most of a
+//power of two goes to a slot of 1.25x, 1.5x or 1.75x the lower power instead
+//slots are carved from one buddy block (a run) which is freed back to the
+//buddy system, and merged as usual, once its last slot is freed
+typedef struct SizeClassRun
+{
+    SizeClassRun* next; // runs of this class with free slots
+    SizeClassRun* prev;
+    MetaData* free_slots;
+    size_t class_size; // slot size including its metadata
+    size_t num_of_slots;
+    size_t used_slots;
+    size_t carved_slots; // slots after this one were never handed out
+}SizeClassRun;
+#define RUN_HEADER_SIZE ((sizeof(SizeClassRun)+sizeof(MetaData)-1)/sizeof(MetaData)*sizeof(MetaData))
+
+/*
+---------------------------------------
+            PAGE MAP
+---------------------------------------
+*/
+//two level radix map from page to owner, so sfree/srealloc can tell mmap
+//blocks, arena blocks and pointers we never gave out apart without the header
+//0 is not ours, PAGE_OWNER_ARENA is the sbrk arena, otherwise the mmap metadata
+//an mmap block only has its first page in the map, its payload always starts there
+//leaves are created once and never freed, so reads need no lock
+#define PAGE_SHIFT 12
+#define PAGE_MAP_LEAF_BITS 18
+#define PAGE_MAP_ROOT_BITS 18 // covers 48 bit addresses
+#define PAGE_OWNER_ARENA ((uintptr_t)1)
+
+uintptr_t* page_map_root[1<<PAGE_MAP_ROOT_BITS];
+
+static uintptr_t* page_map_leaf(uintptr_t page, bool create)
+{
+    uintptr_t root_index=page>>PAGE_MAP_LEAF_BITS;
+    if(root_index>=(1<<PAGE_MAP_ROOT_BITS))
+    {
+        return NULL;
+    }
+    uintptr_t* leaf=__atomic_load_n(&page_map_root[root_index],__ATOMIC_ACQUIRE);
+    if(leaf!=NULL || !create)
+    {
+        return leaf;
+    }
+    void* new_leaf=mmap(NULL,sizeof(uintptr_t)<<PAGE_MAP_LEAF_BITS,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+    if(new_leaf==MAP_FAILED)
+    {
+        return NULL;
+    }
+    uintptr_t* expected=NULL;
+    if(!__atomic_compare_exchange_n(&page_map_root[root_index],&expected,(uintptr_t*)new_leaf,false,__ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE))
+    {
+        //someone else won, use theirs
+        munmap(new_leaf,sizeof(uintptr_t)<<PAGE_MAP_LEAF_BITS);
+        return expected;
+    }
+    return (uintptr_t*)new_leaf;
+}
+static bool page_map_set(void* start, size_t bytes, uintptr_t owner)
+{
+    uintptr_t first_page=(uintptr_t)start>>PAGE_SHIFT;
+    uintptr_t last_page=((uintptr_t)start+bytes-1)>>PAGE_SHIFT;
+    for(uintptr_t page=first_page;page<=last_page;page++)
+    {
+        uintptr_t* leaf=page_map_leaf(page,owner!=0);
+        if(leaf==NULL)
+        {
+            if(owner!=0)
+            {
+                return false;
+            }
+            continue;
+        }
+        __atomic_store_n(&leaf[page&((1<<PAGE_MAP_LEAF_BITS)-1)],owner,__ATOMIC_RELEASE);
+    }
+    return true;
+}
+//the arena pages all share one finer leaf, an entry per 32 bytes (every
+//payload in the arena starts on one) that is set while a block is handed out
+//low byte is order+1 for a buddy block or BLOCK_ENTRY_SLOT|class for a run
+//slot, high byte is the tag, 0 means no live block starts here
+#define ARENA_MAP_UNIT 32
+#define ARENA_MAP_SIZE (NUM_OF_REGIONS*MAX_SIZE_BLOCK/ARENA_MAP_UNIT)
+#define BLOCK_ENTRY_SLOT 0x80
+
+char* arena_map_start=NULL;
+uint16_t arena_block_map[ARENA_MAP_SIZE];
+
+//NULL if p can not be the start of an arena payload
+static inline uint16_t* arena_block_entry(void* p)
+{
+    uintptr_t offset=(uintptr_t)((char*)p-arena_map_start);
+    if(offset%ARENA_MAP_UNIT!=0 || offset>=(uintptr_t)NUM_OF_REGIONS*MAX_SIZE_BLOCK)
+    {
+        return NULL;
+    }
+    return &arena_block_map[offset/ARENA_MAP_UNIT];
+}
+static inline uintptr_t page_map_get(void* p)
+{
+    uintptr_t page=(uintptr_t)p>>PAGE_SHIFT;
+    uintptr_t* leaf=page_map_leaf(page,false);
+    if(leaf==NULL)
+    {
+        return 0;
+    }
+    return __atomic_load_n(&leaf[page&((1<<PAGE_MAP_LEAF_BITS)-1)],__ATOMIC_ACQUIRE);
+}
+
 //we need a list for all the blocks
 
 class BlockTable
@@ -29,13 +167,20 @@ class BlockTable
    size_t num_of_blocks_not_used_by_mmap;
    MetaData* allocated_by_mmap;
    MetaData* array[MAX_ORDER+1];
+   char* heap_start;
+   int region_lifetime[NUM_OF_REGIONS];
+   size_t num_of_merges;
+   SizeClassRun* class_runs[NUM_OF_CLASSES];
 public:
-    BlockTable():bytes_used_not_by_mmap(0),num_of_blocks_not_used_by_mmap(0),allocated_by_mmap(NULL)
+    //constexpr so the global table is ready before any initializer runs
+    //(the arrays are zeroed, and a zero region_lifetime is SLIFETIME_SHORT)
+    constexpr BlockTable():bytes_used_not_by_mmap(0),num_of_blocks_not_used_by_mmap(0),allocated_by_mmap(NULL),array(),heap_start(NULL),region_lifetime(),num_of_merges(0),class_runs()
     {
-        for(int i=0;i<=MAX_ORDER;i++)
-        {
-            array[i]=NULL;
-        }
+
+    }
+    int get_region_of_block(MetaData* block)
+    {
+        return (int)(((char*)block-heap_start)/MAX_SIZE_BLOCK);
     }
     MetaData* get_start_of_block(void* block)
     {
@@ -138,8 +283,13 @@ public:
         block->next=NULL;
         block->prev=NULL;
     }
-    MetaData* find_best_block_for_allocation(size_t size)
+    //plain requests count as short lived, any_region drops the region filter
+    MetaData* find_best_block_for_allocation(size_t size, int lifetime=SLIFETIME_ANY, bool any_region=false)
     {
+        if(lifetime==SLIFETIME_ANY)
+        {
+            lifetime=SLIFETIME_SHORT;
+        }
         int order=0;
         size_t num=128;
         while(size+sizeof(MetaData)>num)
@@ -154,11 +304,19 @@ public:
             {
                 if(list->size>=size && list->is_free)
                 {
-                    return list;
+                    //whole regions are free for everyone, split ones only for their class
+                    if(any_region || i==MAX_ORDER || region_lifetime[get_region_of_block(list)]==lifetime)
+                    {
+                        return list;
+                    }
                 }
                 list=list->next;
             }
         }
+        if(!any_region) // no region of our class, take whatever fits
+        {
+            return find_best_block_for_allocation(size,lifetime,true);
+        }
         return NULL;
     }
     void split_block(MetaData* block_to_split)
@@ -173,14 +331,18 @@ public:
 
         insert_block_to_array(second_half); // insert the free block back
     }
-    MetaData* allocate_block_without_mmap(size_t size)
+    MetaData* allocate_block_without_mmap(size_t size, int lifetime=SLIFETIME_ANY)
     {
-        MetaData* optimal_block=find_best_block_for_allocation(size);
+        MetaData* optimal_block=find_best_block_for_allocation(size,lifetime);
         if(optimal_block==NULL)
         {
             //what to do? Is it possible?
             return NULL;
         }
+        if(get_order_of_block(optimal_block)==MAX_ORDER) // we open a region, it is ours now
+        {
+            region_lifetime[get_region_of_block(optimal_block)]=(lifetime==SLIFETIME_ANY)?SLIFETIME_SHORT:lifetime;
+        }
 
         //we have our block. Can it be seperated?
         delete_block_from_array(optimal_block);
@@ -208,7 +370,7 @@ public:
             return;
         }
         MetaData* buddy=calculate_xor_of_pointers_for_buddy_search(block_to_free,(block_to_free->size+sizeof(MetaData)));
-        if(!buddy->is_free)
+        if(!buddy->is_free || buddy->size!=block_to_free->size) // a split buddy is not whole yet
         {
             insert_block_to_array(block_to_free);
             block_to_free->is_free=true;
@@ -216,7 +378,7 @@ public:
         }
         MetaData* first;
         MetaData* second;
-        while(buddy->is_free)
+        while(buddy->is_free && buddy->size==block_to_free->size)
         {
             //we can merge :)
             delete_block_from_array(buddy);
@@ -232,6 +394,7 @@ public:
                 second=block_to_free;
             }
             first->size=first->size+sizeof(MetaData)+second->size;
+            num_of_merges++;
             if(first->size>=MAX_SIZE_BLOCK-sizeof(MetaData))
             {
                 break;
@@ -269,6 +432,10 @@ public:
         if(block->prev==NULL)
         {
             allocated_by_mmap=block->next;
+            if(block->next!=NULL)
+            {
+                (block->next)->prev=NULL;
+            }
             block->next=NULL;
             return;
         }
@@ -296,16 +463,161 @@ public:
         }
 
         MetaData* block_allocated=(MetaData*)mmap_block;
+        if(!page_map_set(mmap_block,1,(uintptr_t)block_allocated))
+        {
+            munmap(mmap_block,sizeof(MetaData)+size);
+            return NULL;
+        }
         insert_mmap_block(block_allocated);
         block_allocated->size=size;
         block_allocated->is_free=false;
         return block_allocated;
     }
+    //size (no metadata) of the buddy block that will serve size
+    size_t get_buddy_block_size(size_t size)
+    {
+        size_t num=BLOCK_UNIT;
+        while(size+sizeof(MetaData)>num)
+        {
+            num=num*2;
+        }
+        return num-sizeof(MetaData);
+    }
+    //-1 if the plain buddy block fits well enough
+    int get_size_class(size_t size)
+    {
+        size_t total=size+sizeof(MetaData);
+        size_t power=MIN_CLASS_POWER;
+        int index=0;
+        while(power<total)
+        {
+            power=power*2;
+            index++;
+        }
+        size_t half=power/2;
+        if(power>MAX_CLASS_POWER || total<=half)
+        {
+            return -1;
+        }
+        for(int step=1;step<=3;step++)
+        {
+            if(half+half*step/4>=total)
+            {
+                return index*3+step-1;
+            }
+        }
+        return -1;
+    }
+    size_t get_class_size(int size_class)
+    {
+        size_t half=(MIN_CLASS_POWER/2)<<(size_class/3);
+        return half+half*(size_class%3+1)/4;
+    }
+    void unlink_run(SizeClassRun* run, int size_class)
+    {
+        if(run->prev!=NULL)
+        {
+            run->prev->next=run->next;
+        }
+        else
+        {
+            class_runs[size_class]=run->next;
+        }
+        if(run->next!=NULL)
+        {
+            run->next->prev=run->prev;
+        }
+        run->next=NULL;
+        run->prev=NULL;
+    }
+    void push_run(SizeClassRun* run, int size_class)
+    {
+        run->prev=NULL;
+        run->next=class_runs[size_class];
+        if(run->next!=NULL)
+        {
+            run->next->prev=run;
+        }
+        class_runs[size_class]=run;
+    }
+    //buddy block size (with metadata) of the runs of size_class
+    size_t get_run_size(int size_class)
+    {
+        size_t class_size=get_class_size(size_class);
+        size_t run_size=BLOCK_UNIT;
+        while(run_size<sizeof(MetaData)+RUN_HEADER_SIZE+MIN_SLOTS_IN_RUN*class_size && run_size<MAX_SIZE_BLOCK)
+        {
+            run_size=run_size*2;
+        }
+        return run_size;
+    }
+    MetaData* allocate_block_from_run(int size_class)
+    {
+        SizeClassRun* run=class_runs[size_class];
+        if(run==NULL) // open a new run
+        {
+            size_t class_size=get_class_size(size_class);
+            MetaData* run_block=allocate_block_without_mmap(get_run_size(size_class)-sizeof(MetaData));
+            if(run_block==NULL)
+            {
+                return NULL;
+            }
+            run=(SizeClassRun*)((char*)run_block+sizeof(MetaData));
+            run->free_slots=NULL;
+            run->class_size=class_size;
+            run->num_of_slots=(run_block->size-RUN_HEADER_SIZE)/class_size;
+            run->used_slots=0;
+            run->carved_slots=0;
+            push_run(run,size_class);
+        }
+        MetaData* slot;
+        if(run->free_slots!=NULL)
+        {
+            slot=run->free_slots;
+            run->free_slots=slot->next;
+        }
+        else
+        {
+            slot=(MetaData*)((char*)run+RUN_HEADER_SIZE+run->carved_slots*run->class_size);
+            run->carved_slots++;
+        }
+        run->used_slots++;
+        if(run->used_slots==run->num_of_slots) // full, stop looking at it
+        {
+            unlink_run(run,size_class);
+        }
+        slot->size=run->class_size-sizeof(MetaData);
+        slot->is_free=false;
+        slot->next=NULL;
+        slot->prev=NULL;
+        return slot;
+    }
+    void free_run_block(MetaData* slot, int size_class)
+    {
+        //runs are buddy blocks, so they are aligned to their size
+        size_t run_size=get_run_size(size_class);
+        size_t offset=((char*)slot-heap_start) & ~(run_size-1);
+        SizeClassRun* run=(SizeClassRun*)(heap_start+offset+sizeof(MetaData));
+        if(run->used_slots==run->num_of_slots) // was full, it has room again
+        {
+            push_run(run,size_class);
+        }
+        slot->is_free=true;
+        slot->next=run->free_slots;
+        run->free_slots=slot;
+        run->used_slots--;
+        if(run->used_slots==0) // give the whole run back to the buddy system
+        {
+            unlink_run(run,size_class);
+            free_used_block((MetaData*)((char*)run-sizeof(MetaData)));
+        }
+    }
     void free_mmap_allocated_block(void* block_to_free)
     {
         MetaData* meta_data_for_block=(MetaData*)get_start_of_block(block_to_free);
         remove_mmap_block(meta_data_for_block);
-        munmap(block_to_free,meta_data_for_block->size+sizeof(MetaData));
+        page_map_set(meta_data_for_block,1,0);
+        munmap(meta_data_for_block,meta_data_for_block->size+sizeof(MetaData));
     }
     bool can_merge_to_create_block(MetaData* current, size_t size)
     {
@@ -313,7 +625,7 @@ public:
         while(current_size<MAX_SIZE_BLOCK-sizeof(MetaData))
         {
             MetaData* buddy=calculate_xor_of_pointers_for_buddy_search(current,sizeof(MetaData)+current_size); // buddy
-            if(!buddy->is_free)
+            if(!buddy->is_free || buddy->size!=current_size)
             {
                 return false;
             }
@@ -336,7 +648,7 @@ public:
         MetaData* buddy=calculate_xor_of_pointers_for_buddy_search(current,sizeof(MetaData)+current->size);
         MetaData* first=current;
         MetaData* second;
-        while(buddy->is_free)
+        while(buddy->is_free && buddy->size==current->size)
         {
             //we can merge :)
             delete_block_from_array(buddy);
@@ -351,6 +663,7 @@ public:
                 second=current;
             }
             first->size=first->size+sizeof(MetaData)+second->size;
+            num_of_merges++;
             current=first;
             if(current->size>=size)
             {
@@ -444,6 +757,67 @@ public:
         }
         return counter;
     }
+    size_t get_number_of_merges()
+    {
+        return num_of_merges;
+    }
+    //split larger free blocks until order has at least count free blocks
+    void presplit(int order, size_t count)
+    {
+        if(order<0 || order>=MAX_ORDER)
+        {
+            return;
+        }
+        while(true)
+        {
+            size_t free_in_order=0;
+            for(MetaData* current=array[order];current!=NULL && free_in_order<count;current=current->next)
+            {
+                free_in_order++;
+            }
+            if(free_in_order>=count)
+            {
+                return;
+            }
+            int bigger=order+1;
+            while(bigger<=MAX_ORDER && array[bigger]==NULL)
+            {
+                bigger++;
+            }
+            if(bigger>MAX_ORDER) // nothing left to split
+            {
+                return;
+            }
+            MetaData* block=array[bigger];
+            if(bigger==MAX_ORDER) // we open a region for plain smalloc
+            {
+                region_lifetime[get_region_of_block(block)]=SLIFETIME_SHORT;
+            }
+            delete_block_from_array(block);
+            split_block(block);
+            insert_block_to_array(block);
+        }
+    }
+    //fault in the first bytes of the arena without changing their content
+    void prefault(size_t bytes)
+    {
+        if(bytes>NUM_OF_REGIONS*MAX_SIZE_BLOCK)
+        {
+            bytes=NUM_OF_REGIONS*MAX_SIZE_BLOCK;
+        }
+#ifdef MADV_POPULATE_WRITE
+        if(madvise(heap_start,bytes,MADV_POPULATE_WRITE)==0)
+        {
+            return;
+        }
+#endif
+        long page_size=sysconf(_SC_PAGESIZE);
+        for(size_t offset=0;offset<bytes;offset+=page_size)
+        {
+            volatile char* place=heap_start+offset;
+            *place=*place;
+        }
+    }
     void first_assign()
     {
         //allinment
@@ -452,13 +826,21 @@ public:
         intptr_t aligned_p_break_adress = (p_break_adress + ALLINMENT_FACTOR - 1) & ~(ALLINMENT_FACTOR - 1);
         sbrk(aligned_p_break_adress - p_break_adress);
         //creating
+        void* p_break=sbrk(NUM_OF_REGIONS*MAX_SIZE_BLOCK);
+        assign_region((char*)p_break,NUM_OF_REGIONS);
+        page_map_set(p_break,NUM_OF_REGIONS*MAX_SIZE_BLOCK,PAGE_OWNER_ARENA);
+        arena_map_start=(char*)p_break;
+    }
+    //carve memory aligned to MAX_SIZE_BLOCK into free order 10 blocks
+    void assign_region(char* start, int num_of_blocks)
+    {
+        heap_start=start;
         size_t allocation_cost=MAX_SIZE_BLOCK;
         size_t size_of_data=allocation_cost-sizeof(MetaData);
-        for(int i=0;i<32;i++)
+        for(int i=0;i<num_of_blocks;i++)
         {
-            void* p_break=sbrk(allocation_cost);
             // allocate the new block
-            MetaData* new_block_allocated=(MetaData*)p_break;
+            MetaData* new_block_allocated=(MetaData*)(start+i*allocation_cost);
             new_block_allocated->size=size_of_data;
             new_block_allocated->is_free=true;
             new_block_allocated->next=NULL;
@@ -468,6 +850,110 @@ public:
     }
 };
 
+/*
+---------------------------------------
+            RECORDER
+---------------------------------------
+*/
+//opt-in, writes every call to a memory mapped ring file (see srecord.h)
+//when off, each call pays a single NULL check
+//srecord_stop only syncs the file, the mapping stays so a thread that already
+//saw the recorder on can still write its record
+SRecordHeader* recorder_ring=NULL;
+thread_local uint32_t recorder_thread_id=0;
+
+#if defined(__x86_64__) || defined(__i386__)
+#define RECORDER_CLOCK SRECORD_CLOCK_TSC
+#else
+#define RECORDER_CLOCK SRECORD_CLOCK_NS
+#endif
+
+static inline uint64_t recorder_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    return (uint64_t)now.tv_sec*1000000000ull+now.tv_nsec;
+}
+static inline uint64_t recorder_timestamp()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return recorder_ns();
+#endif
+}
+static void recorder_write(SRecordHeader* ring, uint32_t op, size_t size, void* id, void* result_id, int lifetime)
+{
+    if(recorder_thread_id==0) // gettid once per thread
+    {
+        recorder_thread_id=(uint32_t)syscall(SYS_gettid);
+    }
+    uint64_t index=__atomic_fetch_add(&ring->head,1,__ATOMIC_RELAXED);
+    SRecord* record=(SRecord*)(ring+1)+index%ring->capacity;
+    record->timestamp=recorder_timestamp();
+    record->size=size;
+    record->id=(uint64_t)(uintptr_t)id;
+    record->result_id=(uint64_t)(uintptr_t)result_id;
+    record->thread_id=recorder_thread_id;
+    record->op=op;
+    record->lifetime=lifetime;
+}
+//the ring is loaded once, srecord_stop may clear it meanwhile
+#define SRECORD(op,size,id,result_id) \
+    do { SRecordHeader* active_ring=__atomic_load_n(&recorder_ring,__ATOMIC_ACQUIRE); \
+         if(__builtin_expect(active_ring!=NULL,0)) recorder_write(active_ring,op,size,id,result_id,0); } while(0)
+#define SRECORD_HINTED(size,lifetime,result_id) \
+    do { SRecordHeader* active_ring=__atomic_load_n(&recorder_ring,__ATOMIC_ACQUIRE); \
+         if(__builtin_expect(active_ring!=NULL,0)) recorder_write(active_ring,SRECORD_MALLOC_HINT,size,NULL,result_id,lifetime); } while(0)
+
+bool srecord_start(const char* path, size_t capacity)
+{
+    if(recorder_ring!=NULL || path==NULL || capacity==0)
+    {
+        return false;
+    }
+    int fd=open(path,O_RDWR|O_CREAT|O_TRUNC,0644);
+    if(fd<0)
+    {
+        return false;
+    }
+    size_t file_size=sizeof(SRecordHeader)+capacity*sizeof(SRecord);
+    if(ftruncate(fd,file_size)!=0)
+    {
+        close(fd);
+        return false;
+    }
+    void* ring=mmap(NULL,file_size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+    close(fd); // the mapping keeps the file alive
+    if(ring==MAP_FAILED)
+    {
+        return false;
+    }
+    SRecordHeader* header=(SRecordHeader*)ring;
+    header->magic=SRECORD_MAGIC;
+    header->record_size=sizeof(SRecord);
+    header->capacity=capacity;
+    header->head=0;
+    header->clock=RECORDER_CLOCK;
+    header->start_ticks=recorder_timestamp();
+    header->start_ns=recorder_ns();
+    __atomic_store_n(&recorder_ring,header,__ATOMIC_RELEASE);
+    return true;
+}
+//the file is complete once this returns, but its mapping is never unmapped
+//(one per srecord_start) since other threads may still be writing into it
+void srecord_stop()
+{
+    SRecordHeader* header=__atomic_exchange_n(&recorder_ring,(SRecordHeader*)NULL,__ATOMIC_ACQ_REL);
+    if(header==NULL)
+    {
+        return;
+    }
+    header->stop_ticks=recorder_timestamp();
+    header->stop_ns=recorder_ns();
+    msync(header,sizeof(SRecordHeader)+header->capacity*sizeof(SRecord),MS_SYNC);
+}
+
 /*
 ---------------------------------------
             IMPLEMENTATION
@@ -476,15 +962,59 @@ public:
 
 //global list
 BlockTable table=BlockTable();
-bool allocate=false;
 
-void* smalloc(size_t size)
+//the arena is built when the library is loaded, before the static
+//initializers of any other file (101 is the first priority we may use),
+//so smalloc does not need a first call check
+//SMALLOC_PREFAULT=<bytes> also faults in that much of the arena
+__attribute__((constructor(101))) static void eager_init()
+{
+    table.first_assign();
+    const char* prefault_bytes=getenv("SMALLOC_PREFAULT");
+    if(prefault_bytes!=NULL)
+    {
+        table.prefault(strtoull(prefault_bytes,NULL,10));
+    }
+}
+
+//per tag accounting, the allocator is single threaded so plain counters will do
+size_t tag_live_bytes[MAX_TAGS];
+size_t tag_live_blocks[MAX_TAGS];
+size_t tag_budget[MAX_TAGS]; // 0 means no budget
+thread_local unsigned char current_tag=0;
+
+//off by default, see SizeClassRun
+bool fine_size_classes=false;
+
+static inline void tag_account_allocation(MetaData* block, unsigned char tag)
+{
+    block->tag=tag;
+    tag_live_bytes[tag]+=block->size;
+    tag_live_blocks[tag]++;
+}
+static inline void tag_account_release(size_t size, unsigned char tag)
 {
-    if(!allocate)
+    tag_live_bytes[tag]-=size;
+    tag_live_blocks[tag]--;
+}
+//publish a freshly handed out arena block in the arena block map
+static inline void arena_mark_block(MetaData* block, unsigned char tag, int size_class)
+{
+    uint16_t* entry=arena_block_entry((char*)block+sizeof(MetaData));
+    unsigned char kind;
+    if(size_class!=-1)
+    {
+        kind=BLOCK_ENTRY_SLOT|size_class;
+    }
+    else
     {
-        allocate=true;
-        table.first_assign();
+        kind=table.get_order_of_block(block)+1;
     }
+    *entry=(uint16_t)((tag<<8)|kind);
+}
+
+static void* allocate_memory(size_t size, unsigned char tag, int lifetime=SLIFETIME_ANY)
+{
     //size conditions
     if(size ==0)
     {
@@ -494,49 +1024,135 @@ void* smalloc(size_t size)
     {
         return NULL;
     }
+    int size_class=-1;
+    if(fine_size_classes && lifetime==SLIFETIME_ANY && size<MAX_SIZE_BLOCK)
+    {
+        size_class=table.get_size_class(size);
+    }
+    if(tag_budget[tag]!=0) // the tag is charged the whole block, not just size
+    {
+        size_t charged=size;
+        if(size_class!=-1)
+        {
+            charged=table.get_class_size(size_class)-sizeof(MetaData);
+        }
+        else if(size<MAX_SIZE_BLOCK)
+        {
+            charged=table.get_buddy_block_size(size);
+        }
+        if(tag_live_bytes[tag]+charged>tag_budget[tag]) // over budget
+        {
+            return NULL;
+        }
+    }
     void* p_break;
     if(size>=MAX_SIZE_BLOCK)
     {
         p_break=table.allocate_block_with_mmap(size);
     }
+    else if(size_class!=-1)
+    {
+        p_break=table.allocate_block_from_run(size_class);
+    }
     else
     {
-        p_break=table.allocate_block_without_mmap(size);
+        p_break=table.allocate_block_without_mmap(size,lifetime);
     }
     //if allocation failed
     if(p_break==NULL)
     {
         return NULL;
     }
+    tag_account_allocation((MetaData*)p_break,tag);
+    if(size<MAX_SIZE_BLOCK)
+    {
+        arena_mark_block((MetaData*)p_break,tag,size_class);
+    }
     return (char*)p_break+sizeof(MetaData);
 }
-void* scalloc(size_t num, size_t size)
+//what the maps know about a block we handed out
+typedef struct BlockInfo
 {
-    //so we need the same behaviour as smalloc, but set all to 0
-    void* place=smalloc(size*num); // will also check for size*num constrains
-    if(place==NULL) // problem detected
+    MetaData* block;
+    size_t size; // without metadata
+    unsigned char tag;
+    bool is_mmap;
+    int size_class; // -1 unless it is a run slot
+    uint16_t* entry; // arena block map entry, NULL for mmap blocks
+}BlockInfo;
+
+//false if p is not the start of a live block we handed out
+//arena blocks are answered from the maps alone, mmap blocks read their own
+//header (munmap needs the size anyway)
+static bool lookup_block(void* p, BlockInfo* info)
+{
+    uintptr_t owner=page_map_get(p);
+    if(owner==0) // not ours
     {
-        return NULL;
+        return false;
     }
-    memset(place,0,size*num); // we were told to use it in the pdf
-    return place;
+    info->block=table.get_start_of_block(p);
+    if(owner!=PAGE_OWNER_ARENA)
+    {
+        if((MetaData*)owner!=info->block) // inside an mmap block
+        {
+            return false;
+        }
+        info->is_mmap=true;
+        info->size=info->block->size;
+        info->tag=info->block->tag;
+        info->size_class=-1;
+        info->entry=NULL;
+        return true;
+    }
+    uint16_t* entry=arena_block_entry(p);
+    if(entry==NULL || *entry==0) // inside a block, or already free
+    {
+        return false;
+    }
+    unsigned char kind=*entry&0xff;
+    info->is_mmap=false;
+    info->tag=*entry>>8;
+    info->entry=entry;
+    if(kind&BLOCK_ENTRY_SLOT)
+    {
+        info->size_class=kind&~BLOCK_ENTRY_SLOT;
+        info->size=table.get_class_size(info->size_class)-sizeof(MetaData);
+    }
+    else
+    {
+        info->size_class=-1;
+        info->size=((size_t)BLOCK_UNIT<<(kind-1))-sizeof(MetaData);
+    }
+    return true;
 }
-void sfree(void* p)
+static void release_memory(void* p)
 {
     if(p!=NULL)
     {
-        MetaData* metadata=table.get_start_of_block(p);
-        if(metadata->size>=MAX_SIZE_BLOCK) //mmap
+        BlockInfo info;
+        if(!lookup_block(p,&info))
+        {
+            return;
+        }
+        tag_account_release(info.size,info.tag);
+        if(info.is_mmap) //mmap
         {
             table.free_mmap_allocated_block(p);
+            return;
+        }
+        *info.entry=0;
+        if(info.size_class!=-1) //size class slot
+        {
+            table.free_run_block(info.block,info.size_class);
         }
         else //regular
         {
-            table.free_used_block(metadata);
+            table.free_used_block(info.block);
         }
     }
 }
-void* srealloc(void* oldp, size_t size)
+static void* reallocate_memory(void* oldp, size_t size)
 {
     //size conditions
     if(size ==0)
@@ -551,72 +1167,179 @@ void* srealloc(void* oldp, size_t size)
     //no previous block
     if(oldp==NULL)
     {
-        return smalloc(size);
+        return allocate_memory(size,current_tag);
     }
-    MetaData* details=(MetaData*)table.get_start_of_block(oldp);
-    if(details->size>MAX_SIZE_BLOCK) // mmaped
+    BlockInfo info;
+    if(!lookup_block(oldp,&info)) // not ours
     {
-        if(details->size==size) // according to pdf
+        return NULL;
+    }
+    unsigned char tag=info.tag; // the new block stays with the same owner
+    if(info.is_mmap) // mmaped
+    {
+        if(info.size==size) // according to pdf
         {
             return oldp;
         }
-        void* new_mmap_block=smalloc(size);
+        void* new_mmap_block=allocate_memory(size,tag);
         if(new_mmap_block==NULL)
         {
             return NULL;
         }
-        if(size>details->size)
+        if(size>info.size)
         {
-            memmove(new_mmap_block,oldp,details->size);
+            memmove(new_mmap_block,oldp,info.size);
         }
         else
         {
             memmove(new_mmap_block,oldp,size);
         }
-        sfree(oldp);
+        release_memory(oldp);
         return new_mmap_block;
     }
     else //regular
     {
         // try to use this block first
-        if(details->size>=size)
+        if(info.size>=size)
         {
             return oldp;
         }
-        if(table.can_merge_to_create_block(details,size)) // check if we can merge
+        if(info.size_class==-1 && table.can_merge_to_create_block(info.block,size)) // check if we can merge
         {
+            //the merged block is charged whole, same budget check as allocate_memory
+            if(tag_budget[tag]!=0 && tag_live_bytes[tag]-info.size+table.get_buddy_block_size(size)>tag_budget[tag])
+            {
+                return NULL;
+            }
             //make it return the new Metadata
-            MetaData* new_allocated=table.merge_to_create_block(details,size);
+            tag_account_release(info.size,tag);
+            *info.entry=0;
+            MetaData* new_allocated=table.merge_to_create_block(info.block,size);
             void* adrees_of_data=(char*)new_allocated+sizeof(MetaData);
-            memmove(adrees_of_data,oldp,details->size);
+            memmove(adrees_of_data,oldp,info.size);
             new_allocated->is_free=false;
             new_allocated->prev=NULL;
             new_allocated->next=NULL;
+            tag_account_allocation(new_allocated,tag);
+            arena_mark_block(new_allocated,tag,-1);
             return (char*)new_allocated+sizeof(MetaData);
         }
     }
 
     //we need a new block
 
-    MetaData* metadata=(MetaData*)table.get_start_of_block(oldp);
-    void* new_block=smalloc(size);
+    void* new_block=allocate_memory(size,tag);
     if(new_block==NULL)
     {
         return NULL;
     }
-    memmove(new_block,oldp,metadata->size); // copy the content
-    sfree(oldp);
+    memmove(new_block,oldp,info.size); // copy the content
+    release_memory(oldp);
     return new_block;
 }
-size_t _num_free_blocks()
+void* smalloc(size_t size)
 {
-    return table.get_number_of_all_free_blocks();
+    void* result=allocate_memory(size,current_tag);
+    SRECORD(SRECORD_MALLOC,size,NULL,result);
+    return result;
 }
-size_t _num_free_bytes()
+void* smalloc_hint(size_t size, int lifetime)
 {
-    return table.get_sum_of_all_free_bytes();
-}
-size_t _num_allocated_blocks()
+    if(lifetime<SLIFETIME_SHORT || lifetime>SLIFETIME_PERMANENT)
+    {
+        lifetime=SLIFETIME_ANY;
+    }
+    void* result=allocate_memory(size,current_tag,lifetime);
+    if(lifetime==SLIFETIME_ANY)
+    {
+        SRECORD(SRECORD_MALLOC,size,NULL,result);
+    }
+    else
+    {
+        SRECORD_HINTED(size,lifetime,result);
+    }
+    return result;
+}
+void* smalloc_tagged(size_t size, unsigned char tag)
+{
+    void* result=allocate_memory(size,tag);
+    SRECORD(SRECORD_MALLOC,size,NULL,result);
+    return result;
+}
+//untagged calls from this thread go to tag, returns the previous one
+unsigned char sset_current_tag(unsigned char tag)
+{
+    unsigned char previous=current_tag;
+    current_tag=tag;
+    return previous;
+}
+//allocations that would take tag over bytes fail, 0 removes the budget
+void sset_tag_budget(unsigned char tag, size_t bytes)
+{
+    tag_budget[tag]=bytes;
+}
+void* scalloc(size_t num, size_t size)
+{
+    //so we need the same behaviour as smalloc, but set all to 0
+    void* place=allocate_memory(size*num,current_tag); // will also check for size*num constrains
+    if(place==NULL) // problem detected
+    {
+        SRECORD(SRECORD_CALLOC,size*num,NULL,NULL);
+        return NULL;
+    }
+    memset(place,0,size*num); // we were told to use it in the pdf
+    SRECORD(SRECORD_CALLOC,size*num,NULL,place);
+    return place;
+}
+void sfree(void* p)
+{
+    SRECORD(SRECORD_FREE,0,p,NULL);
+    release_memory(p);
+}
+void* srealloc(void* oldp, size_t size)
+{
+    void* result=reallocate_memory(oldp,size);
+    SRECORD(SRECORD_REALLOC,size,oldp,result);
+    return result;
+}
+//runs only serve unhinted requests, hinted ones keep their regions
+//runs count as one allocated block each in the _num_ statistics
+void smalloc_set_fine_classes(bool enabled)
+{
+    fine_size_classes=enabled;
+}
+//0 for NULL and for pointers we did not hand out
+size_t smalloc_usable_size(void* p)
+{
+    if(p==NULL)
+    {
+        return 0;
+    }
+    BlockInfo info;
+    if(!lookup_block(p,&info))
+    {
+        return 0;
+    }
+    return info.size;
+}
+void sprefault(size_t bytes)
+{
+    table.prefault(bytes);
+}
+//keep count free blocks of order ready so the first requests do not split
+void spresplit(int order, size_t count)
+{
+    table.presplit(order,count);
+}
+size_t _num_free_blocks()
+{
+    return table.get_number_of_all_free_blocks();
+}
+size_t _num_free_bytes()
+{
+    return table.get_sum_of_all_free_bytes();
+}
+size_t _num_allocated_blocks()
 {
     return table.get_number_of_all_blocks();
 }
@@ -624,6 +1347,34 @@ size_t _num_allocated_bytes()
 {
     return table.get_sum_of_all_bytes();
 }
+size_t _num_merges()
+{
+    return table.get_number_of_merges();
+}
+size_t _num_tagged_bytes(unsigned char tag)
+{
+    return tag_live_bytes[tag];
+}
+size_t _num_tagged_blocks(unsigned char tag)
+{
+    return tag_live_blocks[tag];
+}
+//copy the first count tags, either array may be NULL
+void _tag_snapshot(size_t* live_bytes, size_t* live_blocks, size_t count)
+{
+    if(count>MAX_TAGS)
+    {
+        count=MAX_TAGS;
+    }
+    if(live_bytes!=NULL)
+    {
+        memcpy(live_bytes,tag_live_bytes,count*sizeof(size_t));
+    }
+    if(live_blocks!=NULL)
+    {
+        memcpy(live_blocks,tag_live_blocks,count*sizeof(size_t));
+    }
+}
 size_t _size_meta_data()
 {
     return sizeof(MetaData);
@@ -631,4 +1382,516 @@ size_t _size_meta_data()
 size_t _num_meta_data_bytes()
 {
     return (_size_meta_data()*_num_allocated_blocks());
+}
+
+/*
+---------------------------------------
+            ARENA
+---------------------------------------
+*/
+//bump allocation inside chunks taken from smalloc, everything is freed at once
+#define ARENA_ALIGNMENT 16
+#define ARENA_DEFAULT_CHUNK_SIZE (MAX_SIZE_BLOCK/2-sizeof(MetaData))
+
+typedef struct ArenaChunk
+{
+    ArenaChunk* next;
+    size_t capacity;
+    size_t used;
+}ArenaChunk;
+
+typedef struct SArena
+{
+    ArenaChunk* chunks; // head is the chunk we bump in
+    ArenaChunk* big_chunks; // one per oversized request, never bumped
+    size_t chunk_size;
+}SArena;
+
+static ArenaChunk* arena_new_chunk(size_t capacity)
+{
+    ArenaChunk* chunk=(ArenaChunk*)smalloc(sizeof(ArenaChunk)+capacity);
+    if(chunk==NULL)
+    {
+        return NULL;
+    }
+    chunk->next=NULL;
+    chunk->capacity=capacity;
+    chunk->used=0;
+    return chunk;
+}
+static void arena_free_chunks(ArenaChunk* current)
+{
+    while(current!=NULL)
+    {
+        ArenaChunk* next=current->next;
+        sfree(current);
+        current=next;
+    }
+}
+SArena* sarena_create(size_t chunk_size)
+{
+    if(chunk_size==0)
+    {
+        chunk_size=ARENA_DEFAULT_CHUNK_SIZE-sizeof(ArenaChunk);
+    }
+    if(chunk_size > MAX_MEMORY_ALLOCATED_SIZE) // the chunk header would wrap it
+    {
+        return NULL;
+    }
+    SArena* arena=(SArena*)smalloc(sizeof(SArena));
+    if(arena==NULL)
+    {
+        return NULL;
+    }
+    arena->chunk_size=chunk_size;
+    arena->big_chunks=NULL;
+    arena->chunks=arena_new_chunk(chunk_size);
+    if(arena->chunks==NULL)
+    {
+        sfree(arena);
+        return NULL;
+    }
+    return arena;
+}
+void* sarena_alloc(SArena* arena, size_t size)
+{
+    if(arena==NULL || size==0 || size > MAX_MEMORY_ALLOCATED_SIZE)
+    {
+        return NULL;
+    }
+    if(size+ARENA_ALIGNMENT>arena->chunk_size) // big request gets its own chunk
+    {
+        ArenaChunk* big_chunk=arena_new_chunk(size+ARENA_ALIGNMENT);
+        if(big_chunk==NULL)
+        {
+            return NULL;
+        }
+        big_chunk->next=arena->big_chunks;
+        arena->big_chunks=big_chunk;
+        uintptr_t big_start=(uintptr_t)((char*)big_chunk+sizeof(ArenaChunk));
+        big_chunk->used=big_chunk->capacity;
+        return (void*)((big_start+ARENA_ALIGNMENT-1) & ~(uintptr_t)(ARENA_ALIGNMENT-1));
+    }
+    ArenaChunk* chunk=arena->chunks;
+    uintptr_t start=(uintptr_t)((char*)chunk+sizeof(ArenaChunk));
+    uintptr_t aligned=(start+chunk->used+ARENA_ALIGNMENT-1) & ~(uintptr_t)(ARENA_ALIGNMENT-1);
+    if(aligned+size>start+chunk->capacity) // no room, open a new chunk
+    {
+        ArenaChunk* new_chunk=arena_new_chunk(arena->chunk_size);
+        if(new_chunk==NULL)
+        {
+            return NULL;
+        }
+        new_chunk->next=chunk;
+        arena->chunks=new_chunk;
+        chunk=new_chunk;
+        start=(uintptr_t)((char*)chunk+sizeof(ArenaChunk));
+        aligned=(start+ARENA_ALIGNMENT-1) & ~(uintptr_t)(ARENA_ALIGNMENT-1);
+    }
+    chunk->used=aligned+size-start;
+    return (void*)aligned;
+}
+void sarena_reset(SArena* arena)
+{
+    if(arena==NULL)
+    {
+        return;
+    }
+    //keep the head chunk for reuse, give back the rest
+    arena_free_chunks(arena->chunks->next);
+    arena_free_chunks(arena->big_chunks);
+    arena->chunks->next=NULL;
+    arena->chunks->used=0;
+    arena->big_chunks=NULL;
+}
+void sarena_destroy(SArena* arena)
+{
+    if(arena==NULL)
+    {
+        return;
+    }
+    arena_free_chunks(arena->chunks);
+    arena_free_chunks(arena->big_chunks);
+    sfree(arena);
+}
+
+/*
+---------------------------------------
+            SHARED HEAP
+---------------------------------------
+*/
+//a small buddy heap inside a shm_open region, for zero copy messaging
+//every link is an offset from the start of the region, so each process may
+//map it wherever it likes, processes pass offsets (sshm_alloc) and turn them
+//into their own pointers (sshm_pointer)
+//the heap has its own orders, up to the biggest power of two that fits, so a
+//message may take most of the region
+//a byte per BLOCK_UNIT (order+1 where a live block starts, 0 elsewhere) is the
+//truth about what is handed out, sshm_free checks it and the free lists are
+//rebuilt from it when a process dies holding the lock
+#define SSHM_MAGIC 0x4d485353 // "SSHM"
+#define SSHM_NULL ((size_t)-1)
+#define SSHM_MAX_ORDER 40
+
+typedef struct SharedMallocMetadata
+{
+    size_t size;
+    bool is_free;
+    size_t next; // offsets, SSHM_NULL ends the list
+    size_t prev;
+}SharedMetaData;
+
+typedef struct SharedHeap
+{
+    uint32_t magic;
+    int ready;
+    size_t mapping_size;
+    size_t map_offset; // the live block map
+    size_t blocks_offset; // buddies are found relative to it
+    size_t blocks_size;
+    int top_order;
+    pthread_mutex_t lock; // process shared and robust
+    size_t free_lists[SSHM_MAX_ORDER+1];
+}SharedHeap;
+
+SharedHeap* shared_heap=NULL;
+
+static inline SharedMetaData* shared_block(SharedHeap* heap, size_t offset)
+{
+    return (SharedMetaData*)((char*)heap+offset);
+}
+static inline unsigned char* shared_map_entry(SharedHeap* heap, size_t offset)
+{
+    return (unsigned char*)heap+heap->map_offset+(offset-heap->blocks_offset)/BLOCK_UNIT;
+}
+static int shared_order_of_size(size_t size)
+{
+    size_t size_with_metadata=(sizeof(SharedMetaData)+size)/BLOCK_UNIT;
+    int order=0;
+    while(size_with_metadata>1)
+    {
+        size_with_metadata=size_with_metadata/2;
+        order++;
+    }
+    return order;
+}
+static void shared_push(SharedHeap* heap, size_t offset)
+{
+    SharedMetaData* block=shared_block(heap,offset);
+    int order=shared_order_of_size(block->size);
+    block->is_free=true;
+    block->prev=SSHM_NULL;
+    block->next=heap->free_lists[order];
+    if(block->next!=SSHM_NULL)
+    {
+        shared_block(heap,block->next)->prev=offset;
+    }
+    heap->free_lists[order]=offset;
+}
+static void shared_remove(SharedHeap* heap, size_t offset)
+{
+    SharedMetaData* block=shared_block(heap,offset);
+    if(block->prev!=SSHM_NULL)
+    {
+        shared_block(heap,block->prev)->next=block->next;
+    }
+    else
+    {
+        heap->free_lists[shared_order_of_size(block->size)]=block->next;
+    }
+    if(block->next!=SSHM_NULL)
+    {
+        shared_block(heap,block->next)->prev=block->prev;
+    }
+    block->next=SSHM_NULL;
+    block->prev=SSHM_NULL;
+    block->is_free=false;
+}
+//SSHM_NULL when the buddy would be past the end of the heap
+static size_t shared_buddy(SharedHeap* heap, size_t offset)
+{
+    size_t total=shared_block(heap,offset)->size+sizeof(SharedMetaData);
+    size_t buddy=(offset-heap->blocks_offset)^total;
+    if(buddy+total>heap->blocks_size)
+    {
+        return SSHM_NULL;
+    }
+    return buddy+heap->blocks_offset;
+}
+static size_t shared_allocate(SharedHeap* heap, size_t size)
+{
+    int order=0;
+    size_t num=BLOCK_UNIT;
+    while(size+sizeof(SharedMetaData)>num)
+    {
+        num=num*2;
+        order++;
+    }
+    int found=order;
+    while(found<=heap->top_order && heap->free_lists[found]==SSHM_NULL)
+    {
+        found++;
+    }
+    if(found>heap->top_order)
+    {
+        return SSHM_NULL;
+    }
+    size_t offset=heap->free_lists[found];
+    shared_remove(heap,offset);
+    SharedMetaData* block=shared_block(heap,offset);
+    //split down, the upper halves go back to the free lists
+    while(found>order)
+    {
+        size_t half=(block->size+sizeof(SharedMetaData))/2;
+        block->size=half-sizeof(SharedMetaData);
+        shared_block(heap,offset+half)->size=half-sizeof(SharedMetaData);
+        shared_push(heap,offset+half);
+        found--;
+    }
+    //published last, a process dying before this leaves the block free
+    *shared_map_entry(heap,offset)=order+1;
+    return offset;
+}
+static void shared_release(SharedHeap* heap, size_t offset)
+{
+    *shared_map_entry(heap,offset)=0;
+    SharedMetaData* block=shared_block(heap,offset);
+    while(shared_order_of_size(block->size)<heap->top_order)
+    {
+        size_t buddy_offset=shared_buddy(heap,offset);
+        if(buddy_offset==SSHM_NULL)
+        {
+            break;
+        }
+        SharedMetaData* buddy=shared_block(heap,buddy_offset);
+        if(!buddy->is_free || buddy->size!=block->size)
+        {
+            break;
+        }
+        //we can merge :)
+        shared_remove(heap,buddy_offset);
+        if(buddy_offset<offset)
+        {
+            offset=buddy_offset;
+        }
+        size_t merged_size=block->size*2+sizeof(SharedMetaData);
+        block=shared_block(heap,offset);
+        block->size=merged_size;
+    }
+    shared_push(heap,offset);
+}
+static bool shared_has_live_block(SharedHeap* heap, size_t offset, size_t bytes)
+{
+    unsigned char* entry=shared_map_entry(heap,offset);
+    for(size_t i=0;i<bytes/BLOCK_UNIT;i++)
+    {
+        if(entry[i]!=0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+//hand every piece of [offset, offset+block of order) without a live block to the free lists
+static void shared_rebuild_range(SharedHeap* heap, size_t offset, int order)
+{
+    size_t bytes=(size_t)BLOCK_UNIT<<order;
+    if(*shared_map_entry(heap,offset)==order+1) // a live block
+    {
+        return;
+    }
+    if(!shared_has_live_block(heap,offset,bytes))
+    {
+        shared_block(heap,offset)->size=bytes-sizeof(SharedMetaData);
+        shared_push(heap,offset);
+        return;
+    }
+    if(order==0)
+    {
+        return;
+    }
+    shared_rebuild_range(heap,offset,order-1);
+    shared_rebuild_range(heap,offset+bytes/2,order-1);
+}
+//the free lists only follow from the live block map, so this both sets up a
+//new heap and repairs one that a dead process left halfway through an update
+static void shared_rebuild(SharedHeap* heap)
+{
+    for(int i=0;i<=SSHM_MAX_ORDER;i++)
+    {
+        heap->free_lists[i]=SSHM_NULL;
+    }
+    //biggest pieces first, so every piece is aligned to its size
+    size_t carved=0;
+    for(int order=heap->top_order;order>=0;order--)
+    {
+        if(heap->blocks_size-carved>=(size_t)BLOCK_UNIT<<order)
+        {
+            shared_rebuild_range(heap,heap->blocks_offset+carved,order);
+            carved+=(size_t)BLOCK_UNIT<<order;
+        }
+    }
+}
+static void shared_lock(SharedHeap* heap)
+{
+    if(pthread_mutex_lock(&heap->lock)==EOWNERDEAD) // the last holder died inside
+    {
+        shared_rebuild(heap);
+        pthread_mutex_consistent(&heap->lock);
+    }
+}
+
+bool sshm_create(const char* name, size_t num_of_blocks)
+{
+    if(shared_heap!=NULL || num_of_blocks==0 ||
+       num_of_blocks>((size_t)BLOCK_UNIT<<SSHM_MAX_ORDER)/MAX_SIZE_BLOCK)
+    {
+        return false;
+    }
+    int fd=shm_open(name,O_RDWR|O_CREAT|O_EXCL,0600);
+    if(fd<0)
+    {
+        return false;
+    }
+    size_t blocks_size=num_of_blocks*MAX_SIZE_BLOCK;
+    size_t map_offset=sizeof(SharedHeap);
+    size_t blocks_offset=(map_offset+blocks_size/BLOCK_UNIT+BLOCK_UNIT-1)/BLOCK_UNIT*BLOCK_UNIT;
+    size_t mapping_size=blocks_offset+blocks_size;
+    if(ftruncate(fd,mapping_size)!=0) // zero filled, so the map starts empty
+    {
+        close(fd);
+        shm_unlink(name);
+        return false;
+    }
+    void* region=mmap(NULL,mapping_size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+    close(fd);
+    if(region==MAP_FAILED)
+    {
+        shm_unlink(name);
+        return false;
+    }
+    SharedHeap* heap=(SharedHeap*)region;
+    heap->magic=SSHM_MAGIC;
+    heap->mapping_size=mapping_size;
+    heap->map_offset=map_offset;
+    heap->blocks_offset=blocks_offset;
+    heap->blocks_size=blocks_size;
+    heap->top_order=shared_order_of_size(blocks_size-sizeof(SharedMetaData));
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_setpshared(&attributes,PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attributes,PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&heap->lock,&attributes);
+    pthread_mutexattr_destroy(&attributes);
+    shared_rebuild(heap);
+    __atomic_store_n(&heap->ready,1,__ATOMIC_RELEASE);
+    shared_heap=heap;
+    return true;
+}
+//fails if the creator is not done yet, caller may retry
+bool sshm_attach(const char* name)
+{
+    if(shared_heap!=NULL)
+    {
+        return false;
+    }
+    int fd=shm_open(name,O_RDWR,0600);
+    if(fd<0)
+    {
+        return false;
+    }
+    //the creator may not have sized the object yet, reading it would SIGBUS
+    struct stat shm_stat;
+    if(fstat(fd,&shm_stat)!=0 || (size_t)shm_stat.st_size<sizeof(SharedHeap))
+    {
+        close(fd);
+        return false;
+    }
+    void* region=mmap(NULL,shm_stat.st_size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+    close(fd);
+    if(region==MAP_FAILED)
+    {
+        return false;
+    }
+    SharedHeap* heap=(SharedHeap*)region;
+    if(heap->magic!=SSHM_MAGIC || !__atomic_load_n(&heap->ready,__ATOMIC_ACQUIRE) ||
+       heap->mapping_size!=(size_t)shm_stat.st_size)
+    {
+        munmap(region,shm_stat.st_size);
+        return false;
+    }
+    shared_heap=heap;
+    return true;
+}
+void sshm_detach()
+{
+    if(shared_heap==NULL)
+    {
+        return;
+    }
+    munmap(shared_heap,shared_heap->mapping_size);
+    shared_heap=NULL;
+}
+bool sshm_destroy(const char* name)
+{
+    sshm_detach();
+    return shm_unlink(name)==0;
+}
+size_t sshm_alloc(size_t size)
+{
+    if(shared_heap==NULL || size==0)
+    {
+        return SSHM_NULL;
+    }
+    if(size>shared_heap->blocks_size-sizeof(SharedMetaData)) // can never fit
+    {
+        return SSHM_NULL;
+    }
+    shared_lock(shared_heap);
+    size_t offset=shared_allocate(shared_heap,size);
+    pthread_mutex_unlock(&shared_heap->lock);
+    if(offset==SSHM_NULL)
+    {
+        return SSHM_NULL;
+    }
+    return offset+sizeof(SharedMetaData);
+}
+//offsets that are not a live block of this heap (double frees too) are ignored
+void sshm_free(size_t offset)
+{
+    if(shared_heap==NULL || offset==SSHM_NULL)
+    {
+        return;
+    }
+    if(offset<shared_heap->blocks_offset+sizeof(SharedMetaData) || offset>=shared_heap->mapping_size)
+    {
+        return; // not a block of this heap
+    }
+    size_t block_offset=offset-sizeof(SharedMetaData);
+    if((block_offset-shared_heap->blocks_offset)%BLOCK_UNIT!=0)
+    {
+        return;
+    }
+    shared_lock(shared_heap);
+    if(*shared_map_entry(shared_heap,block_offset)!=0)
+    {
+        shared_release(shared_heap,block_offset);
+    }
+    pthread_mutex_unlock(&shared_heap->lock);
+}
+void* sshm_pointer(size_t offset)
+{
+    if(shared_heap==NULL || offset==SSHM_NULL)
+    {
+        return NULL;
+    }
+    return (char*)shared_heap+offset;
+}
+size_t sshm_offset(void* p)
+{
+    if(shared_heap==NULL || p==NULL)
+    {
+        return SSHM_NULL;
+    }
+    return (char*)p-(char*)shared_heap;
 }
\ No newline at end of file
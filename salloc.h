@@ -0,0 +1,193 @@
+#ifndef SALLOC_H
+#define SALLOC_H
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <utility>
+
+/*
+---------------------------------------
+        C++ ADAPTORS FOR MALLOC_3
+---------------------------------------
+*/
+//link with malloc_3.cpp
+void* smalloc(size_t size);
+void sfree(void* p);
+
+//smalloc payloads start 32 bytes into a block that is at least 32 aligned
+#define SALLOC_ALIGNMENT 32
+
+//standard allocator on top of smalloc/sfree, for std::vector, std::map...
+//sfree finds the size in the block metadata, so n is not needed on deallocate
+//types aligned past SALLOC_ALIGNMENT get a bigger block, aligned inside it, and
+//the pointer smalloc gave us is kept right before the object
+template <typename T>
+class SAllocator
+{
+public:
+    typedef T value_type;
+
+    SAllocator() noexcept
+    {
+
+    }
+    template <typename U>
+    SAllocator(const SAllocator<U>&) noexcept
+    {
+
+    }
+    T* allocate(size_t n)
+    {
+        size_t extra=0;
+        if(alignof(T)>SALLOC_ALIGNMENT)
+        {
+            extra=alignof(T);
+        }
+        if(n==0 || n>((size_t)-1-extra)/sizeof(T))
+        {
+            throw std::bad_alloc();
+        }
+        void* place=smalloc(n*sizeof(T)+extra);
+        if(place==NULL)
+        {
+            throw std::bad_alloc();
+        }
+        if(extra==0)
+        {
+            return (T*)place;
+        }
+        //at least SALLOC_ALIGNMENT bytes are skipped, room for the original pointer
+        uintptr_t aligned=((uintptr_t)place+alignof(T)) & ~(uintptr_t)(alignof(T)-1);
+        ((void**)aligned)[-1]=place;
+        return (T*)aligned;
+    }
+    void deallocate(T* p, size_t)
+    {
+        if(alignof(T)>SALLOC_ALIGNMENT)
+        {
+            sfree(((void**)p)[-1]);
+            return;
+        }
+        sfree(p);
+    }
+};
+template <typename T, typename U>
+bool operator==(const SAllocator<T>&, const SAllocator<U>&) noexcept
+{
+    return true;
+}
+template <typename T, typename U>
+bool operator!=(const SAllocator<T>&, const SAllocator<U>&) noexcept
+{
+    return false;
+}
+
+//typed object pool, slots are carved from buddy blocks and recycled
+//through a free list so construct/destroy are O(1)
+#define SPOOL_CHUNK_BYTES (4096-64) // fits one order 5 block with its metadata
+#define SPOOL_MIN_SLOTS 16
+
+template <typename T>
+class SPool
+{
+    union Slot
+    {
+        Slot* next_free;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+    struct Chunk
+    {
+        Chunk* next;
+    };
+    //slots start after the chunk header, aligned for T from the chunk address
+    //header_size is the worst case, the real padding depends on where smalloc put the chunk
+    static const size_t header_size=sizeof(Chunk)+alignof(Slot)-1;
+
+    Chunk* chunks;
+    Slot* free_slots;
+    Slot* bump_current; // not yet used slots of the newest chunk
+    Slot* bump_end;
+    size_t slots_per_chunk;
+
+    bool add_chunk()
+    {
+        Chunk* chunk=(Chunk*)smalloc(header_size+slots_per_chunk*sizeof(Slot));
+        if(chunk==NULL)
+        {
+            return false;
+        }
+        chunk->next=chunks;
+        chunks=chunk;
+        uintptr_t first_slot=((uintptr_t)(chunk+1)+alignof(Slot)-1) & ~(uintptr_t)(alignof(Slot)-1);
+        bump_current=(Slot*)first_slot;
+        bump_end=bump_current+slots_per_chunk;
+        return true;
+    }
+public:
+    SPool():chunks(NULL),free_slots(NULL),bump_current(NULL),bump_end(NULL)
+    {
+        slots_per_chunk=0;
+        if(header_size<SPOOL_CHUNK_BYTES)
+        {
+            slots_per_chunk=(SPOOL_CHUNK_BYTES-header_size)/sizeof(Slot);
+        }
+        if(slots_per_chunk<SPOOL_MIN_SLOTS)
+        {
+            slots_per_chunk=SPOOL_MIN_SLOTS;
+        }
+    }
+    SPool(const SPool&)=delete;
+    SPool& operator=(const SPool&)=delete;
+    //live objects are not destroyed, only their memory is given back
+    ~SPool()
+    {
+        while(chunks!=NULL)
+        {
+            Chunk* next=chunks->next;
+            sfree(chunks);
+            chunks=next;
+        }
+    }
+    template <typename... Args>
+    T* construct(Args&&... args)
+    {
+        Slot* slot;
+        if(free_slots!=NULL)
+        {
+            slot=free_slots;
+            free_slots=slot->next_free;
+        }
+        else
+        {
+            if(bump_current==bump_end && !add_chunk())
+            {
+                throw std::bad_alloc();
+            }
+            slot=bump_current++;
+        }
+        try
+        {
+            return new (slot->storage) T(std::forward<Args>(args)...);
+        }
+        catch(...)
+        {
+            slot->next_free=free_slots;
+            free_slots=slot;
+            throw;
+        }
+    }
+    void destroy(T* object)
+    {
+        if(object==NULL)
+        {
+            return;
+        }
+        object->~T();
+        Slot* slot=(Slot*)object;
+        slot->next_free=free_slots;
+        free_slots=slot;
+    }
+};
+
+#endif
\ No newline at end of file
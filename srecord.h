@@ -0,0 +1,72 @@
+#ifndef SRECORD_H
+#define SRECORD_H
+
+#include <cstdint>
+
+/*
+---------------------------------------
+        ALLOCATION RECORD FORMAT
+---------------------------------------
+*/
+//shared by the recorder in malloc_3.cpp and by sreplay.cpp
+//the file is a header followed by a ring of fixed size records
+#define SRECORD_MAGIC 0x43455253 // "SREC"
+
+enum SRecordOp
+{
+    SRECORD_MALLOC=1,
+    SRECORD_CALLOC=2,
+    SRECORD_REALLOC=3,
+    SRECORD_FREE=4,
+    SRECORD_MALLOC_HINT=5 // smalloc_hint, lifetime holds the hint
+};
+
+//record timestamps are raw ticks of clock, the header pairs them with
+//CLOCK_MONOTONIC nanoseconds at start and stop so tools can convert them
+enum SRecordClock
+{
+    SRECORD_CLOCK_NS=1, // ticks are CLOCK_MONOTONIC nanoseconds
+    SRECORD_CLOCK_TSC=2 // ticks are x86 time stamp counter cycles
+};
+
+typedef struct SRecordHeader
+{
+    uint32_t magic;
+    uint32_t record_size;
+    uint64_t capacity; // number of records in the ring
+    uint64_t head; // total records ever written, slot is head%capacity
+    uint32_t clock;
+    uint32_t reserved;
+    uint64_t start_ticks;
+    uint64_t start_ns;
+    uint64_t stop_ticks; // 0 until srecord_stop
+    uint64_t stop_ns;
+}SRecordHeader;
+
+//nanoseconds since start for a record timestamp, 0 if the run was not stopped
+static inline uint64_t srecord_ticks_to_ns(const SRecordHeader* header, uint64_t ticks)
+{
+    if(header->clock==SRECORD_CLOCK_NS)
+    {
+        return ticks-header->start_ticks;
+    }
+    if(header->stop_ticks<=header->start_ticks)
+    {
+        return 0;
+    }
+    double ns_per_tick=(double)(header->stop_ns-header->start_ns)/(header->stop_ticks-header->start_ticks);
+    return (uint64_t)((ticks-header->start_ticks)*ns_per_tick);
+}
+
+typedef struct SRecord
+{
+    uint64_t timestamp;
+    uint64_t size; // for calloc this is num*size
+    uint64_t id; // pointer passed in (realloc, free)
+    uint64_t result_id; // pointer returned (malloc, calloc, realloc)
+    uint32_t thread_id;
+    uint16_t op;
+    uint16_t lifetime; // only for SRECORD_MALLOC_HINT
+}SRecord;
+
+#endif
\ No newline at end of file
@@ -0,0 +1,178 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unordered_map>
+#include "srecord.h"
+
+/*
+---------------------------------------
+            REPLAY TOOL
+---------------------------------------
+*/
+//drives one of the allocators with a file written by srecord_start
+//build against the version to test, for example:
+//g++ -O2 sreplay.cpp malloc_3.cpp -o sreplay
+//malloc_1 only has smalloc, so the other calls are weak and emulated when missing
+//(smalloc_hint only exists in malloc_3)
+void* smalloc(size_t size);
+void* scalloc(size_t num, size_t size) __attribute__((weak));
+void sfree(void* p) __attribute__((weak));
+void* srealloc(void* oldp, size_t size) __attribute__((weak));
+void* smalloc_hint(size_t size, int lifetime) __attribute__((weak));
+
+static double seconds_now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    return now.tv_sec+now.tv_nsec/1e9;
+}
+
+int main(int argc, char* argv[])
+{
+    if(argc!=2)
+    {
+        fprintf(stderr,"usage: %s <record file>\n",argv[0]);
+        return 1;
+    }
+    int fd=open(argv[1],O_RDONLY);
+    if(fd<0)
+    {
+        perror("open");
+        return 1;
+    }
+    struct stat file_stat;
+    if(fstat(fd,&file_stat)!=0 || (size_t)file_stat.st_size<sizeof(SRecordHeader))
+    {
+        fprintf(stderr,"bad record file\n");
+        close(fd);
+        return 1;
+    }
+    void* file=mmap(NULL,file_stat.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+    close(fd);
+    if(file==MAP_FAILED)
+    {
+        perror("mmap");
+        return 1;
+    }
+    const SRecordHeader* header=(const SRecordHeader*)file;
+    if(header->magic!=SRECORD_MAGIC || header->record_size!=sizeof(SRecord) ||
+       sizeof(SRecordHeader)+header->capacity*sizeof(SRecord)>(size_t)file_stat.st_size)
+    {
+        fprintf(stderr,"bad record file\n");
+        return 1;
+    }
+    const SRecord* ring=(const SRecord*)(header+1);
+
+    //when the ring wrapped we only have the newest capacity records
+    uint64_t first=0;
+    if(header->head>header->capacity)
+    {
+        first=header->head-header->capacity;
+    }
+
+    //recorded pointer -> pointer we got back in this run
+    std::unordered_map<uint64_t,void*> live;
+    size_t failed=0;
+    double start=seconds_now();
+    for(uint64_t i=first;i<header->head;i++)
+    {
+        const SRecord* record=&ring[i%header->capacity];
+        void* result=NULL;
+        switch(record->op)
+        {
+        case SRECORD_MALLOC:
+            result=smalloc(record->size);
+            break;
+        case SRECORD_MALLOC_HINT:
+            if(smalloc_hint!=NULL)
+            {
+                result=smalloc_hint(record->size,record->lifetime);
+            }
+            else
+            {
+                result=smalloc(record->size);
+            }
+            break;
+        case SRECORD_CALLOC:
+            if(scalloc!=NULL)
+            {
+                result=scalloc(1,record->size);
+            }
+            else
+            {
+                result=smalloc(record->size);
+                if(result!=NULL)
+                {
+                    memset(result,0,record->size);
+                }
+            }
+            break;
+        case SRECORD_REALLOC:
+        {
+            void* old=NULL;
+            auto found=live.find(record->id);
+            if(found!=live.end())
+            {
+                old=found->second;
+            }
+            if(srealloc!=NULL)
+            {
+                result=srealloc(old,record->size);
+            }
+            else
+            {
+                result=smalloc(record->size); // no old size to copy in malloc_1
+            }
+            if(result!=NULL && found!=live.end())
+            {
+                live.erase(found);
+            }
+            break;
+        }
+        case SRECORD_FREE:
+        {
+            auto found=live.find(record->id);
+            if(found!=live.end())
+            {
+                if(sfree!=NULL)
+                {
+                    sfree(found->second);
+                }
+                live.erase(found);
+            }
+            break;
+        }
+        default:
+            break;
+        }
+        if(record->op!=SRECORD_FREE)
+        {
+            if(result!=NULL)
+            {
+                live[record->result_id]=result;
+            }
+            else if(record->result_id!=0)
+            {
+                failed++; // recorded run succeeded but this one did not
+            }
+        }
+    }
+    double elapsed=seconds_now()-start;
+    printf("replayed %llu records in %.6f seconds, %zu failed, %zu still live\n",
+           (unsigned long long)(header->head-first),elapsed,failed,live.size());
+    if(header->head>first && header->stop_ns!=0)
+    {
+        uint64_t first_ns=srecord_ticks_to_ns(header,ring[first%header->capacity].timestamp);
+        uint64_t last_ns=srecord_ticks_to_ns(header,ring[(header->head-1)%header->capacity].timestamp);
+        if(last_ns>first_ns) // threads may write slightly out of order
+        {
+            printf("recorded run took %.6f seconds\n",(last_ns-first_ns)/1e9);
+        }
+    }
+    munmap(file,file_stat.st_size);
+    return 0;
+}
\ No newline at end of file